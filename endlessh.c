@@ -14,12 +14,16 @@
 #include <limits.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -32,6 +36,23 @@
 #define DEFAULT_DELAY            10000  /* milliseconds */
 #define DEFAULT_MAX_LINE_LENGTH     32
 #define DEFAULT_MAX_CLIENTS       4096
+#define DEFAULT_MAX_DELAY            0  /* milliseconds, 0 = no escalation */
+#define DEFAULT_DELAY_STEP          30  /* lines per escalation level */
+
+#define DEFAULT_STATSD_INTERVAL  10000  /* milliseconds */
+#define DEFAULT_STATSD_PREFIX   "endlessh"
+
+#define DEFAULT_OFFENDER_SECONDS   3600
+#define DEFAULT_OFFENDER_CONNECTS     0  /* 0 = no connection threshold */
+#define DEFAULT_OFFENDER_INTERVAL 60000  /* milliseconds */
+
+#define DEFAULT_BANNER_CAPTURE       0  /* bytes, 0 = disabled */
+
+#define DELAY_LEVELS                32
+#define BANNER_MAX                  64  /* including terminator */
+#define BANNER_PENDING             256  /* clients awaiting capture */
+#define BANNER_DISTINCT           1024  /* distinct banners counted */
+#define STATSD_DATAGRAM           1432  /* fits a typical path MTU */
 
 #if defined(__FreeBSD__)
 #  define DEFAULT_CONFIG_FILE "/usr/local/etc/endlessh.config"
@@ -44,6 +65,47 @@
 #define XSTR(s) STR(s)
 #define STR(s) #s
 
+/* Static tracepoints (USDT) for bpftrace, SystemTap, and DTrace. Each
+ * probe compiles to a single nop when <sys/sdt.h> is available and to
+ * nothing otherwise. Define ENDLESSH_NO_SDT to leave them out.
+ */
+#if !defined(ENDLESSH_NO_SDT) && defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#    define ENDLESSH_SDT
+#  endif
+#endif
+#if defined(ENDLESSH_SDT)
+#  define PROBE1(n, a)          DTRACE_PROBE1(endlessh, n, a)
+#  define PROBE2(n, a, b)       DTRACE_PROBE2(endlessh, n, a, b)
+#  define PROBE3(n, a, b, c)    DTRACE_PROBE3(endlessh, n, a, b, c)
+#  define PROBE4(n, a, b, c, d) DTRACE_PROBE4(endlessh, n, a, b, c, d)
+#else
+#  define PROBE1(n, a)          do {} while (0)
+#  define PROBE2(n, a, b)       do {} while (0)
+#  define PROBE3(n, a, b, c)    do {} while (0)
+#  define PROBE4(n, a, b, c, d) do {} while (0)
+#endif
+
+/* System interface used by the event loop. A simulation build
+ * (-DENDLESSH_SIM) swaps these for a virtual clock and a synthetic,
+ * seeded population of peers, so scheduling changes can be evaluated
+ * quickly and reproducibly without real sockets.
+ */
+#if !defined(ENDLESSH_SIM)
+
+#define sys_socket      socket
+#define sys_setsockopt  setsockopt
+#define sys_bind        bind
+#define sys_listen      listen
+#define sys_accept      accept
+#define sys_getpeername getpeername
+#define sys_fcntl       fcntl
+#define sys_read        read
+#define sys_write       write
+#define sys_poll        poll
+#define sys_close       close
+
 static long long
 epochms(void)
 {
@@ -52,6 +114,351 @@ epochms(void)
     return tv.tv_sec * 1000ULL + tv.tv_nsec / 1000000ULL;
 }
 
+#else /* ENDLESSH_SIM */
+
+#define SIM_EPOCH    1577836800000LL  /* 2020-01-01T00:00:00Z */
+#define SIM_SERVER   3
+#define SIM_FD_BASE  16
+
+/* Each peer follows a simple script: arrive, optionally stall (writes
+ * would block), and disconnect after its lifetime has passed.
+ */
+enum sim_kind {
+    SIM_SCANNER,  /* gives up within about a minute */
+    SIM_BOT,      /* stays for hours */
+    SIM_STALLER,  /* stays for hours, most writes would block */
+};
+
+struct sim_peer {
+    long long arrive;
+    long long leave;
+    long long accepted;
+    long long closed;
+    long long bytes;
+    unsigned long addr;
+    const char *banner;      /* sent on connect, if any */
+    int banner_read;
+    enum sim_kind kind;
+};
+
+static struct {
+    long long now;
+    long long end;
+    long long next_arrival_us;
+    unsigned long long rng;
+    unsigned long long seed;
+    long rate;               /* arrivals per virtual second */
+    long duration;           /* virtual seconds */
+    struct sim_peer *peers;
+    long npeers;             /* peers that have arrived */
+    long naccepted;
+    long cap;
+    long open;
+    long peak;
+    long long writes;
+} sim = {
+    .now = SIM_EPOCH,
+    .seed = 1,
+    .rate = 100,
+    .duration = 86400,
+};
+
+static unsigned long long
+sim_rand(void)
+{
+    /* splitmix64 */
+    unsigned long long z = (sim.rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void
+sim_init(void)
+{
+    sim.rng = sim.seed;
+    sim.end = sim.now + sim.duration * 1000LL;
+    sim.next_arrival_us = sim.now * 1000 + sim_rand() % (2000000 / sim.rate);
+}
+
+/* Materialize the next peer if it has arrived, returning it or null. */
+static struct sim_peer *
+sim_arrival(void)
+{
+    if (sim.next_arrival_us / 1000 > sim.now)
+        return 0;
+
+    if (sim.npeers == sim.cap) {
+        long cap = sim.cap ? sim.cap * 2 : 4096;
+        void *p = realloc(sim.peers, cap * sizeof(*sim.peers));
+        if (!p) {
+            fprintf(stderr, "endlessh: fatal: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        sim.peers = p;
+        sim.cap = cap;
+    }
+
+    struct sim_peer *p = sim.peers + sim.npeers++;
+    unsigned roll = sim_rand() % 10;
+    p->kind = roll < 5 ? SIM_SCANNER : roll < 9 ? SIM_BOT : SIM_STALLER;
+    long long mean = p->kind == SIM_SCANNER ? 30000 : 3600000;
+    p->arrive = sim.next_arrival_us / 1000;
+    p->leave = p->arrive + sim_rand() % (2 * mean);
+    p->accepted = p->closed = 0;
+    p->bytes = 0;
+    static const char *const families[] = {
+        "SSH-2.0-Go\r\n",
+        "SSH-2.0-libssh2_1.9.0\r\n",
+        "SSH-2.0-paramiko_2.7.2\r\n",
+        "SSH-2.0-OpenSSH_7.4\r\n",
+    };
+    p->banner = p->kind == SIM_STALLER ? 0 : families[sim_rand() % 4];
+    p->banner_read = 0;
+    /* Spread across 64 /16 networks in 100.64.0.0/10 */
+    p->addr = 100UL << 24 | (64 + sim_rand() % 64) << 16 | sim_rand() % 65536;
+
+    sim.next_arrival_us += sim_rand() % (2000000 / sim.rate);
+    return p;
+}
+
+static struct sim_peer *
+sim_peer(int fd)
+{
+    long i = fd - SIM_FD_BASE;
+    return fd >= SIM_FD_BASE && i < sim.npeers ? sim.peers + i : 0;
+}
+
+static long long
+epochms(void)
+{
+    return sim.now;
+}
+
+static int
+sys_socket(int domain, int type, int protocol)
+{
+    (void)domain;
+    (void)type;
+    (void)protocol;
+    return SIM_SERVER;
+}
+
+static int
+sys_setsockopt(int fd, int level, int name, const void *value, socklen_t len)
+{
+    (void)fd;
+    (void)level;
+    (void)name;
+    (void)value;
+    (void)len;
+    return 0;
+}
+
+static int
+sys_bind(int fd, const struct sockaddr *addr, socklen_t len)
+{
+    (void)fd;
+    (void)addr;
+    (void)len;
+    return 0;
+}
+
+static int
+sys_listen(int fd, int backlog)
+{
+    (void)fd;
+    (void)backlog;
+    return 0;
+}
+
+static int
+sys_accept(int fd, struct sockaddr *addr, socklen_t *len)
+{
+    (void)fd;
+    (void)addr;
+    (void)len;
+    if (sim.naccepted == sim.npeers && !sim_arrival()) {
+        errno = ECONNABORTED;
+        return -1;
+    }
+    struct sim_peer *p = sim.peers + sim.naccepted;
+    p->accepted = sim.now;
+    if (++sim.open > sim.peak)
+        sim.peak = sim.open;
+    return SIM_FD_BASE + sim.naccepted++;
+}
+
+static int
+sys_getpeername(int fd, struct sockaddr *addr, socklen_t *len)
+{
+    struct sim_peer *p = sim_peer(fd);
+    if (!p) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    struct sockaddr_in6 *s = (struct sockaddr_in6 *)addr;
+    memset(s, 0, sizeof(*s));
+    s->sin6_family = AF_INET6;
+    s->sin6_port = htons(1024 + p->addr % 60000);
+    s->sin6_addr.s6_addr[10] = s->sin6_addr.s6_addr[11] = 0xff;
+    for (int i = 0; i < 4; i++)
+        s->sin6_addr.s6_addr[12 + i] = p->addr >> (24 - i * 8);
+    *len = sizeof(*s);
+    return 0;
+}
+
+static int
+sys_fcntl(int fd, int cmd, int arg)
+{
+    (void)fd;
+    (void)cmd;
+    (void)arg;
+    return 0;
+}
+
+static ssize_t
+sys_read(int fd, void *buf, size_t len)
+{
+    struct sim_peer *p = sim_peer(fd);
+    if (!p || sim.now >= p->leave)
+        return 0;
+    if (!p->banner || p->banner_read) {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t n = strlen(p->banner);
+    n = n < len ? n : len;
+    memcpy(buf, p->banner, n);
+    p->banner_read = 1;
+    return n;
+}
+
+static ssize_t
+sys_write(int fd, const void *buf, size_t len)
+{
+    (void)buf;
+    struct sim_peer *p = sim_peer(fd);
+    sim.writes++;
+    if (!p || p->closed || sim.now >= p->leave) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (p->kind == SIM_STALLER && sim_rand() % 4) {
+        errno = EAGAIN;
+        return -1;
+    }
+    p->bytes += len;
+    return len;
+}
+
+/* Report ready events or fast-forward the clock to the next one. The
+ * simulation ends with SIGTERM once the clock reaches its duration.
+ */
+static int
+sys_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    long long deadline = timeout < 0 ? sim.end : sim.now + timeout;
+    for (;;) {
+        int ready = 0;
+        long long wake = deadline;
+        for (nfds_t i = 0; i < nfds; i++) {
+            fds[i].revents = 0;
+            if (!(fds[i].events & POLLIN))
+                continue;
+            struct sim_peer *p = sim_peer(fds[i].fd);
+            if (fds[i].fd == SIM_SERVER) {
+                long long arrive = sim.next_arrival_us / 1000;
+                if (sim.naccepted < sim.npeers || arrive <= sim.now) {
+                    fds[i].revents = POLLIN;
+                    ready++;
+                } else if (arrive < wake) {
+                    wake = arrive;
+                }
+            } else if (p && !p->closed) {
+                if ((p->banner && !p->banner_read) || sim.now >= p->leave) {
+                    fds[i].revents = POLLIN;
+                    ready++;
+                } else if (p->leave < wake) {
+                    wake = p->leave;
+                }
+            }
+        }
+        if (ready)
+            return ready;
+
+        if (wake >= sim.end) {
+            sim.now = sim.end;
+            raise(SIGTERM);
+            errno = EINTR;
+            return -1;
+        }
+        sim.now = wake;
+        if (wake == deadline)
+            return 0;
+    }
+}
+
+static int
+sys_close(int fd)
+{
+    struct sim_peer *p = sim_peer(fd);
+    if (p && !p->closed) {
+        p->closed = sim.now;
+        sim.open--;
+    }
+    return 0;
+}
+
+/* Print throughput, memory, and fairness for the simulated run. Fairness
+ * is Jain's index over each accepted peer's bytes per second held.
+ */
+static void
+sim_report(size_t client_size, long long wall_us)
+{
+    /* Count peers still waiting to be accepted */
+    while (sim_arrival())
+        ;
+
+    double sum = 0, sumsq = 0;
+    long n = 0;
+    long long bytes = 0;
+    for (long i = 0; i < sim.naccepted; i++) {
+        struct sim_peer *p = sim.peers + i;
+        long long held = p->closed - p->accepted;
+        bytes += p->bytes;
+        if (held > 0) {
+            double rate = p->bytes * 1000.0 / held;
+            sum += rate;
+            sumsq += rate * rate;
+            n++;
+        }
+    }
+    double seconds = (sim.now - SIM_EPOCH) / 1000.0;
+    double wall = wall_us / 1e6;
+    printf("SIM seed=%llu seconds=%.0f wall=%.3f speedup=%.0f\n",
+           sim.seed, seconds, wall, wall > 0 ? seconds / wall : 0);
+    printf("SIM peers=%ld accepted=%ld backlog=%ld writes=%lld bytes=%lld\n",
+           sim.npeers, sim.naccepted, sim.npeers - sim.naccepted,
+           sim.writes, bytes);
+    printf("SIM writes_per_second=%.1f writes_per_wall_second=%.0f\n",
+           seconds > 0 ? sim.writes / seconds : 0,
+           wall > 0 ? sim.writes / wall : 0);
+    printf("SIM peak_clients=%ld peak_client_bytes=%lld\n",
+           sim.peak, (long long)sim.peak * (long long)client_size);
+    printf("SIM fairness=%.4f\n", sumsq > 0 ? sum * sum / (n * sumsq) : 1.0);
+}
+
+#endif /* ENDLESSH_SIM */
+
+static long long
+monotonicus(void)
+{
+    struct timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec * 1000000LL + tv.tv_nsec / 1000;
+}
+
 static enum loglevel {
     log_none,
     log_info,
@@ -109,56 +516,415 @@ static struct {
     long long connects;
     long long milliseconds;
     long long bytes_sent;
+    long long live_since;  /* sum of connect_time over live clients */
 } statistics;
 
+/* Interned strings, each identified by its insertion index. */
+struct strtab {
+    char *chars;
+    int *offsets;
+    int *slots;            /* hash table of indexes, -1 for empty */
+    int len_chars, cap_chars;
+    int count, cap_offsets;
+    int nslots;
+};
+
+static const char *
+strtab_get(const struct strtab *t, int id)
+{
+    return t->chars + t->offsets[id];
+}
+
+/* Longest-prefix-match table mapping client networks to labels, such as
+ * an ASN and country, with live counters kept per label. The prefixes
+ * are compiled into sorted, non-overlapping address ranges, each with
+ * the label of its most specific prefix, so a lookup is one binary
+ * search. The compiled table is a flat image, mapped read-only:
+ *
+ *   struct netimage       header
+ *   uint32_t[n4]          first address of each IPv4 range
+ *   int32_t[n4]           label of each IPv4 range, -1 for none
+ *   unsigned char[n6][16] first address of each IPv6 range
+ *   int32_t[n6]           label of each IPv6 range, -1 for none
+ *   int32_t[nlabels]      offset of each label name in the strings
+ *   char[len_strings]     null-terminated label names
+ *
+ * The first range of each family starts at the zero address, and labels
+ * are numbered in name order.
+ */
+#define NETIMAGE_MAGIC "endlsh01"
+
+struct netimage {
+    char magic[8];
+    int32_t n4, n6;
+    int32_t nlabels;
+    int32_t len_strings;
+};
+
+struct netlabel {
+    long long connects;
+    long long milliseconds;
+    long long bytes_sent;
+    long long live_since;  /* sum of connect_time over live clients */
+    int live;
+};
+
+static struct nettable {
+    void *image;              /* null when there's no table */
+    size_t size;
+    const uint32_t *v4;
+    const int32_t *v4_labels;
+    const unsigned char (*v6)[16];
+    const int32_t *v6_labels;
+    const int32_t *names;
+    const char *strings;
+    int n4, n6, nlabels;
+    struct netlabel *labels;  /* indexed like names */
+} nettable;
+
+static const char *
+nettable_name(const struct nettable *t, int label)
+{
+    return t->strings + t->names[label];
+}
+
+/* Background build of a new table on reload */
+static struct {
+    pid_t pid;                /* 0 when idle */
+    FILE *image;              /* unlinked file the image is written to */
+    int again;                /* reload requested during the build */
+} netbuild;
+
+/* Power-of-two histogram. Bucket 0 counts values of zero or less and
+ * bucket i counts values in [2^(i-1), 2^i).
+ */
+#define HISTOGRAM_BUCKETS 32
+
+struct histogram {
+    long long count[HISTOGRAM_BUCKETS];
+};
+
+static void
+histogram_add(struct histogram *h, long long value)
+{
+    int i = 0;
+    for (; value > 0 && i < HISTOGRAM_BUCKETS - 1; i++)
+        value >>= 1;
+    h->count[i]++;
+}
+
+/* Log the nonzero buckets keyed by their lower bound, split across as
+ * many lines as needed to keep each one within the syslog buffer.
+ */
+static void
+histogram_log(const struct histogram *h, const char *name)
+{
+    char buf[160];
+    int len = 0;
+    long long total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += h->count[i];
+    logmsg(log_info, "HISTOGRAM %s n=%lld", name, total);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (!h->count[i])
+            continue;
+        char entry[48];
+        long long lower = i ? 1LL << (i - 1) : 0;
+        int n = snprintf(entry, sizeof(entry), " %lld:%lld",
+                         lower, h->count[i]);
+        if (len + n >= (int)sizeof(buf)) {
+            logmsg(log_info, "HISTOGRAM %s%s", name, buf);
+            len = 0;
+        }
+        memcpy(buf + len, entry, n + 1);
+        len += n;
+    }
+    if (len)
+        logmsg(log_info, "HISTOGRAM %s%s", name, buf);
+}
+
+/* Event loop health: how late clients are served, how long each pass
+ * over the queue takes, and how much work each poll() wakeup finds.
+ */
+static struct {
+    struct histogram lateness;   /* milliseconds past send_next */
+    struct histogram iteration;  /* microseconds of work per pass */
+    struct histogram served;     /* clients sent a line per wakeup */
+    struct histogram accepts;    /* clients accepted per wakeup */
+    long long wakeups;
+    long long early_wakeups;     /* woke before the timeout, no work */
+} loopstats;
+
+/* Prefix of IPv4-mapped IPv6 addresses, ::ffff:0:0/96 */
+static const unsigned char v4mapped[12] = {[10] = 0xff, [11] = 0xff};
+
+static int
+is_v4mapped(const unsigned char *addr)
+{
+    return !memcmp(addr, v4mapped, sizeof(v4mapped));
+}
+
+static unsigned long
+hash_string(const char *s, size_t len)
+{
+    unsigned long h = 0x811c9dc5UL;
+    for (size_t i = 0; i < len; i++)
+        h = ((h ^ (unsigned char)s[i]) * 0x01000193UL) & 0xffffffffUL;
+    return h;
+}
+
+static void
+die(void)
+{
+    fprintf(stderr, "endlessh: fatal: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/* Grow an array to hold at least n elements, or die trying. */
+static void *
+grow(void *p, int *cap, int n, size_t size)
+{
+    if (n <= *cap)
+        return p;
+    int newcap = *cap ? *cap : 64;
+    while (newcap < n)
+        newcap *= 2;
+    p = realloc(p, newcap * size);
+    if (!p)
+        die();
+    *cap = newcap;
+    return p;
+}
+
+/* Bounded table of client addresses with their cumulative held time and
+ * connection count, for exporting repeat offenders to a firewall set.
+ * An address lives within OFFENDER_PROBE slots of its hash. Entries are
+ * never deleted, only replaced: when a window is full, the entry with
+ * the least held time is evicted. Slots whose listing changed are queued
+ * so that an export can write only the difference since the last one.
+ */
+#define OFFENDER_SLOTS  65536
+#define OFFENDER_PROBE     16
+
+struct offender {
+    unsigned char addr[16];
+    long long milliseconds;
+    long connects;
+    char used;
+    char listed;
+    char exported;           /* listed as of the last export */
+    char queued;             /* in the changed list */
+};
+
+static struct {
+    struct offender *slots;  /* null when disabled */
+    int *changed;            /* queued slot indexes */
+    int nchanged, cap_changed;
+    unsigned char (*removed)[16];  /* exported, then evicted */
+    int nremoved, cap_removed;
+    long long threshold_ms;
+    long threshold_connects;
+    long long next;          /* earliest time of the next export */
+    long listed;
+    pid_t hook;              /* running hook, or 0 */
+    int full;                /* next export must be a full snapshot */
+    int dirty;               /* listed set changed since last export */
+} offenders;
+
+static void
+offender_queue(struct offender *o)
+{
+    if (!o->queued) {
+        offenders.changed = grow(offenders.changed, &offenders.cap_changed,
+                                 offenders.nchanged + 1, sizeof(int));
+        offenders.changed[offenders.nchanged++] = o - offenders.slots;
+        o->queued = 1;
+    }
+    offenders.dirty = 1;
+}
+
+/* Check an entry against the current thresholds. */
+static void
+offender_update(struct offender *o)
+{
+    int listed = o->milliseconds >= offenders.threshold_ms ||
+                 (offenders.threshold_connects &&
+                  o->connects >= offenders.threshold_connects);
+    if (listed != o->listed) {
+        o->listed = listed;
+        offenders.listed += listed ? 1 : -1;
+        offender_queue(o);
+    }
+}
+
+static void
+offender_record(const unsigned char *addr, long long milliseconds)
+{
+    if (!offenders.slots)
+        return;
+
+    unsigned long hash = hash_string((const char *)addr, 16);
+    struct offender *o = 0;
+    for (int i = 0; i < OFFENDER_PROBE; i++) {
+        struct offender *e = offenders.slots +
+                             ((hash + i) & (OFFENDER_SLOTS - 1));
+        if (!e->used || !memcmp(e->addr, addr, 16)) {
+            o = e;
+            break;
+        }
+        if (!o || e->milliseconds < o->milliseconds)
+            o = e;
+    }
+
+    if (!o->used || memcmp(o->addr, addr, 16)) {
+        if (o->exported) {
+            /* Withdraw the evicted address on the next export */
+            offenders.removed = grow(offenders.removed,
+                                     &offenders.cap_removed,
+                                     offenders.nremoved + 1,
+                                     sizeof(*offenders.removed));
+            memcpy(offenders.removed[offenders.nremoved++], o->addr, 16);
+            offenders.dirty = 1;
+        }
+        if (o->listed)
+            offenders.listed--;
+        char queued = o->queued;
+        memset(o, 0, sizeof(*o));
+        memcpy(o->addr, addr, 16);
+        o->used = 1;
+        o->queued = queued;
+    }
+
+    o->milliseconds += milliseconds;
+    o->connects++;
+    offender_update(o);
+}
+
 struct client {
     char ipaddr[INET6_ADDRSTRLEN];
+    unsigned char addr[16];
     long long connect_time;
     long long send_next;
     long long bytes_sent;
     struct client *next;
     int port;
     int fd;
+    int delay;
+    int level;
+    int lines;
+    int net;
+    int capture;  /* index in banners.clients, -1 if not pending */
+    char banner[BANNER_MAX];
 };
 
+/* Clients waiting for their banner to be captured. Their sockets are
+ * polled in the same poll() call as the server socket, which is always
+ * fds[0], so capture adds no system calls per loop iteration.
+ */
+static struct {
+    struct pollfd fds[1 + BANNER_PENDING];
+    struct client *clients[BANNER_PENDING];
+    int pending;
+    struct strtab seen;
+    long long *counts;       /* indexed like seen */
+    int cap_counts;
+    long long other;         /* banners beyond BANNER_DISTINCT */
+} banners;
+
+/* Set the smallest possible recieve buffer. This reduces local resource
+ * usage and slows down the remote end.
+ */
+static void
+socket_shrink_rcvbuf(int fd)
+{
+    int value = 1;
+    int r = sys_setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
+    logmsg(log_debug, "setsockopt(%d, SO_RCVBUF, %d) = %d", fd, value, r);
+    if (r == -1)
+        logmsg(log_debug, "errno = %d, %s", errno, strerror(errno));
+}
+
+static void
+banner_unwatch(struct client *c)
+{
+    int i = c->capture;
+    int last = --banners.pending;
+    banners.clients[i] = banners.clients[last];
+    banners.fds[i + 1] = banners.fds[last + 1];
+    banners.clients[i]->capture = i;
+    c->capture = -1;
+}
+
+/* Start watching a client for its banner. When all slots are taken, the
+ * longest waiting client is given up on to make room.
+ */
+static void
+banner_watch(struct client *c)
+{
+    if (banners.pending == BANNER_PENDING) {
+        struct client *oldest = banners.clients[0];
+        for (int i = 1; i < banners.pending; i++)
+            if (banners.clients[i]->connect_time < oldest->connect_time)
+                oldest = banners.clients[i];
+        banner_unwatch(oldest);
+        socket_shrink_rcvbuf(oldest->fd);
+    }
+
+    int i = banners.pending++;
+    banners.clients[i] = c;
+    banners.fds[i + 1].fd = c->fd;
+    banners.fds[i + 1].events = POLLIN;
+    banners.fds[i + 1].revents = 0;
+    c->capture = i;
+}
+
+/* Create a client record. Unless its banner is going to be captured, its
+ * receive buffer is shrunk right away.
+ */
 static struct client *
-client_new(int fd, long long send_next)
+client_new(int fd, int delay, int capture)
 {
     struct client *c = malloc(sizeof(*c));
     if (c) {
         c->ipaddr[0] = 0;
         c->connect_time = epochms();
-        c->send_next = send_next;
+        c->send_next = c->connect_time + delay;
+        statistics.live_since += c->connect_time;
         c->bytes_sent = 0;
         c->next = 0;
+        c->delay = delay;
+        c->level = 0;
+        c->lines = 0;
+        c->net = -1;
+        c->capture = -1;
+        c->banner[0] = 0;
+        memset(c->addr, 0, sizeof(c->addr));
         c->fd = fd;
         c->port = 0;
 
-        /* Set the smallest possible recieve buffer. This reduces local
-         * resource usage and slows down the remote end.
-         */
-        int value = 1;
-        int r = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
-        logmsg(log_debug, "setsockopt(%d, SO_RCVBUF, %d) = %d", fd, value, r);
-        if (r == -1)
-            logmsg(log_debug, "errno = %d, %s", errno, strerror(errno));
+        if (!capture)
+            socket_shrink_rcvbuf(fd);
 
         /* Get IP address */
         struct sockaddr_storage addr;
         socklen_t len = sizeof(addr);
-        if (getpeername(fd, (struct sockaddr *)&addr, &len) != -1) {
+        if (sys_getpeername(fd, (struct sockaddr *)&addr, &len) != -1) {
             if (addr.ss_family == AF_INET) {
                 struct sockaddr_in *s = (struct sockaddr_in *)&addr;
                 c->port = ntohs(s->sin_port);
                 inet_ntop(AF_INET, &s->sin_addr,
                           c->ipaddr, sizeof(c->ipaddr));
+                memcpy(c->addr, v4mapped, sizeof(v4mapped));
+                memcpy(c->addr + 12, &s->sin_addr, 4);
             } else {
                 struct sockaddr_in6 *s = (struct sockaddr_in6 *)&addr;
                 c->port = ntohs(s->sin6_port);
+                memcpy(c->addr, &s->sin6_addr, 16);
                 inet_ntop(AF_INET6, &s->sin6_addr,
                           c->ipaddr, sizeof(c->ipaddr));
             }
         }
+        PROBE3(client_new, fd, c->ipaddr, c->port);
     }
     return c;
 }
@@ -168,30 +934,32 @@ client_destroy(struct client *client)
 {
     logmsg(log_debug, "close(%d)", client->fd);
     long long dt = epochms() - client->connect_time;
+    PROBE4(client_destroy, client->fd, client->ipaddr, dt,
+           client->bytes_sent);
+    int banner = !!client->banner[0];
     logmsg(log_info,
             "CLOSE host=%s port=%d fd=%d "
-            "time=%lld.%03lld bytes=%lld",
+            "time=%lld.%03lld bytes=%lld%s%s%s",
             client->ipaddr, client->port, client->fd,
             dt / 1000, dt % 1000,
-            client->bytes_sent);
+            client->bytes_sent,
+            banner ? " banner=\"" : "", client->banner, banner ? "\"" : "");
+    if (client->capture != -1)
+        banner_unwatch(client);
     statistics.milliseconds += dt;
-    close(client->fd);
+    statistics.live_since -= client->connect_time;
+    if (client->ipaddr[0])  /* skip unknown addresses */
+        offender_record(client->addr, dt);
+    if (client->net >= 0) {
+        struct netlabel *label = nettable.labels + client->net;
+        label->milliseconds += dt;
+        label->live_since -= client->connect_time;
+        label->live--;
+    }
+    sys_close(client->fd);
     free(client);
 }
 
-static void
-statistics_log_totals(struct client *clients)
-{
-    long long milliseconds = statistics.milliseconds;
-    for (long long now = epochms(); clients; clients = clients->next)
-        milliseconds += now - clients->connect_time;
-    logmsg(log_info, "TOTALS connects=%lld seconds=%lld.%03lld bytes=%lld",
-           statistics.connects,
-           milliseconds / 1000,
-           milliseconds % 1000,
-           statistics.bytes_sent);
-}
-
 struct fifo {
     struct client *head;
     struct client *tail;
@@ -237,107 +1005,957 @@ fifo_destroy(struct fifo *q)
         c = c->next;
         client_destroy(dead);
     }
-    q->head = q->tail = 0;
-    q->length = 0;
+    q->head = q->tail = 0;
+    q->length = 0;
+}
+
+/* Clients are queued by delay escalation level. All clients in a level
+ * share the same delay, so each level's fifo remains sorted by send_next
+ * and the next client due is at the head of one of the fifos.
+ */
+struct queue {
+    struct fifo levels[DELAY_LEVELS];
+    int length;
+};
+
+static void
+queue_init(struct queue *q)
+{
+    for (int i = 0; i < DELAY_LEVELS; i++)
+        fifo_init(q->levels + i);
+    q->length = 0;
+}
+
+static void
+queue_append(struct queue *q, struct client *c)
+{
+    fifo_append(q->levels + c->level, c);
+    q->length++;
+}
+
+/* Return the level fifo holding the next client due, or null if empty. */
+static struct fifo *
+queue_next(struct queue *q)
+{
+    struct fifo *next = 0;
+    for (int i = 0; i < DELAY_LEVELS; i++) {
+        struct fifo *f = q->levels + i;
+        if (f->head && (!next || f->head->send_next < next->head->send_next))
+            next = f;
+    }
+    return next;
+}
+
+static struct client *
+queue_pop(struct queue *q, struct fifo *f)
+{
+    q->length--;
+    return fifo_pop(f);
+}
+
+static void
+queue_destroy(struct queue *q)
+{
+    for (int i = 0; i < DELAY_LEVELS; i++)
+        fifo_destroy(q->levels + i);
+    q->length = 0;
+}
+
+static void
+statistics_log_totals(struct queue *q)
+{
+    long long milliseconds = statistics.milliseconds;
+    long long delay = 0;
+    long long now = epochms();
+    for (int i = 0; i < DELAY_LEVELS; i++) {
+        for (struct client *c = q->levels[i].head; c; c = c->next) {
+            milliseconds += now - c->connect_time;
+            delay += c->delay;
+        }
+    }
+    logmsg(log_info, "TOTALS connects=%lld seconds=%lld.%03lld bytes=%lld "
+           "clients=%d delay=%lld",
+           statistics.connects,
+           milliseconds / 1000,
+           milliseconds % 1000,
+           statistics.bytes_sent,
+           q->length,
+           q->length ? delay / q->length : 0);
+
+    for (int i = 0; i < nettable.nlabels; i++) {
+        struct netlabel *label = nettable.labels + i;
+        if (!label->connects && !label->live &&
+                !label->milliseconds && !label->bytes_sent)
+            continue;
+        long long ms = label->milliseconds +
+                       label->live * now - label->live_since;
+        logmsg(log_info, "TOTALS net=%s connects=%lld seconds=%lld.%03lld "
+               "bytes=%lld clients=%d",
+               nettable_name(&nettable, i),
+               label->connects,
+               ms / 1000,
+               ms % 1000,
+               label->bytes_sent,
+               label->live);
+    }
+
+    /* Most common captured banners */
+    enum {NTOP = 16};
+    int top[NTOP];
+    int ntop = 0;
+    for (int i = 0; i < banners.seen.count; i++) {
+        long long count = banners.counts[i];
+        int j;
+        if (ntop < NTOP)
+            j = ntop++;
+        else if (count > banners.counts[top[NTOP - 1]])
+            j = NTOP - 1;
+        else
+            continue;
+        for (; j > 0 && banners.counts[top[j - 1]] < count; j--)
+            top[j] = top[j - 1];
+        top[j] = i;
+    }
+    for (int i = 0; i < ntop; i++)
+        logmsg(log_info, "BANNER count=%lld \"%s\"",
+               banners.counts[top[i]], strtab_get(&banners.seen, top[i]));
+    if (banners.other)
+        logmsg(log_info, "BANNER count=%lld other", banners.other);
+
+    logmsg(log_info, "TOTALS wakeups=%lld early=%lld",
+           loopstats.wakeups, loopstats.early_wakeups);
+    histogram_log(&loopstats.lateness, "lateness_ms");
+    histogram_log(&loopstats.iteration, "iteration_us");
+    histogram_log(&loopstats.served, "served");
+    histogram_log(&loopstats.accepts, "accepts");
+}
+
+/* Return the slot where a string is or would be stored. */
+static int *
+strtab_slot(const struct strtab *t, const char *s, size_t len)
+{
+    unsigned long mask = t->nslots - 1;
+    unsigned long i = hash_string(s, len) & mask;
+    for (;; i = (i + 1) & mask) {
+        int *slot = t->slots + i;
+        if (*slot == -1)
+            return slot;
+        const char *other = strtab_get(t, *slot);
+        if (!strncmp(other, s, len) && !other[len])
+            return slot;
+    }
+}
+
+static int
+strtab_find(const struct strtab *t, const char *s, size_t len)
+{
+    return t->nslots ? *strtab_slot(t, s, len) : -1;
+}
+
+/* Return the index of a string, adding it if necessary. */
+static int
+strtab_intern(struct strtab *t, const char *s, size_t len)
+{
+    if (t->nslots < 2 * (t->count + 1)) {
+        /* Rehash to keep the load under 50% */
+        int nslots = t->nslots ? t->nslots * 2 : 256;
+        free(t->slots);
+        t->slots = malloc(nslots * sizeof(*t->slots));
+        if (!t->slots)
+            die();
+        t->nslots = nslots;
+        for (int i = 0; i < nslots; i++)
+            t->slots[i] = -1;
+        for (int i = 0; i < t->count; i++) {
+            const char *other = strtab_get(t, i);
+            *strtab_slot(t, other, strlen(other)) = i;
+        }
+    }
+
+    int *slot = strtab_slot(t, s, len);
+    if (*slot == -1) {
+        t->offsets = grow(t->offsets, &t->cap_offsets,
+                          t->count + 1, sizeof(*t->offsets));
+        t->chars = grow(t->chars, &t->cap_chars, t->len_chars + len + 1, 1);
+        t->offsets[t->count] = t->len_chars;
+        memcpy(t->chars + t->len_chars, s, len);
+        t->chars[t->len_chars + len] = 0;
+        t->len_chars += len + 1;
+        *slot = t->count++;
+    }
+    return *slot;
+}
+
+static void
+strtab_free(struct strtab *t)
+{
+    free(t->chars);
+    free(t->offsets);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+static void
+nettable_free(struct nettable *t)
+{
+    if (t->image)
+        munmap(t->image, t->size);
+    free(t->labels);
+    memset(t, 0, sizeof(*t));
+}
+
+/* Return the label with the given name, or -1. */
+static int
+nettable_find(const struct nettable *t, const char *name)
+{
+    for (int lo = 0, hi = t->nlabels; lo < hi;) {
+        int mid = lo + (hi - lo) / 2;
+        int c = strcmp(nettable_name(t, mid), name);
+        if (!c)
+            return mid;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+/* Return the label of the longest matching prefix, or -1. */
+static int
+nettable_lookup(const struct nettable *t, const unsigned char *addr)
+{
+    if (!t->image)
+        return -1;
+
+    /* Find the last range starting at or below the address */
+    int lo = 0;
+    int hi;
+    if (is_v4mapped(addr)) {
+        uint32_t a = (uint32_t)addr[12] << 24 | (uint32_t)addr[13] << 16 |
+                     (uint32_t)addr[14] <<  8 | (uint32_t)addr[15];
+        for (hi = t->n4; hi - lo > 1;) {
+            int mid = lo + (hi - lo) / 2;
+            if (t->v4[mid] <= a)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        return t->v4_labels[lo];
+    }
+    for (hi = t->n6; hi - lo > 1;) {
+        int mid = lo + (hi - lo) / 2;
+        if (memcmp(t->v6[mid], addr, 16) <= 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return t->v6_labels[lo];
+}
+
+/* Map a compiled image, returning -1 if it can't be used. */
+static int
+nettable_map(struct nettable *t, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return -1;
+    size_t size = st.st_size;
+    if (size < sizeof(struct netimage)) {
+        errno = EINVAL;
+        return -1;
+    }
+    char *p = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+
+    struct netimage h;
+    memcpy(&h, p, sizeof(h));
+    size_t need = sizeof(h) +
+                  (size_t)h.n4 * (sizeof(*t->v4) + sizeof(*t->v4_labels)) +
+                  (size_t)h.n6 * (sizeof(*t->v6) + sizeof(*t->v6_labels)) +
+                  (size_t)h.nlabels * sizeof(*t->names) + h.len_strings;
+    if (memcmp(h.magic, NETIMAGE_MAGIC, sizeof(h.magic)) ||
+            h.n4 < 1 || h.n6 < 1 || h.nlabels < 0 || h.len_strings < 0 ||
+            need != size) {
+        munmap(p, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(t, 0, sizeof(*t));
+    t->image = p;
+    t->size = size;
+    t->n4 = h.n4;
+    t->n6 = h.n6;
+    t->nlabels = h.nlabels;
+    p += sizeof(h);
+    t->v4 = (const uint32_t *)p;
+    p += h.n4 * sizeof(*t->v4);
+    t->v4_labels = (const int32_t *)p;
+    p += h.n4 * sizeof(*t->v4_labels);
+    t->v6 = (const unsigned char (*)[16])p;
+    p += h.n6 * sizeof(*t->v6);
+    t->v6_labels = (const int32_t *)p;
+    p += h.n6 * sizeof(*t->v6_labels);
+    t->names = (const int32_t *)p;
+    p += h.nlabels * sizeof(*t->names);
+    t->strings = p;
+    t->labels = calloc(h.nlabels + 1, sizeof(*t->labels));
+    if (!t->labels)
+        die();
+    return 0;
+}
+
+/* Prefix compiler. Addresses are 128-bit keys, with IPv4 addresses in
+ * the low 32 bits of their own key space.
+ */
+struct netkey {
+    unsigned long long hi, lo;
+};
+
+struct netprefix {
+    struct netkey first, last;
+    int label;
+    int line;
+};
+
+struct netrange {
+    struct netkey start;
+    int label;
+};
+
+struct netname {
+    const char *name;
+    int label;
+};
+
+struct netbuilder {
+    struct netprefix *v4, *v6;
+    int n4, cap_v4;
+    int n6, cap_v6;
+    struct netrange *ranges;
+    int nranges, cap_ranges;
+    int *open;
+    int cap_open;
+    struct strtab names;
+};
+
+static int
+netkey_cmp(struct netkey a, struct netkey b)
+{
+    if (a.hi != b.hi)
+        return a.hi < b.hi ? -1 : 1;
+    if (a.lo != b.lo)
+        return a.lo < b.lo ? -1 : 1;
+    return 0;
+}
+
+static int
+netname_cmp(const void *pa, const void *pb)
+{
+    const struct netname *a = pa;
+    const struct netname *b = pb;
+    return strcmp(a->name, b->name);
+}
+
+/* Order by first address, enclosing prefixes first, then by line. */
+static int
+netprefix_cmp(const void *pa, const void *pb)
+{
+    const struct netprefix *a = pa;
+    const struct netprefix *b = pb;
+    int c = netkey_cmp(a->first, b->first);
+    if (!c)
+        c = netkey_cmp(b->last, a->last);
+    if (!c)
+        c = a->line < b->line ? -1 : a->line > b->line;
+    return c;
+}
+
+/* Append a range, replacing one at the same start and merging into a
+ * preceding range with the same label.
+ */
+static void
+netbuilder_range(struct netbuilder *b, struct netkey start, int label)
+{
+    if (b->nranges && !netkey_cmp(b->ranges[b->nranges - 1].start, start))
+        b->nranges--;
+    if (b->nranges && b->ranges[b->nranges - 1].label == label)
+        return;
+    b->ranges = grow(b->ranges, &b->cap_ranges,
+                     b->nranges + 1, sizeof(*b->ranges));
+    b->ranges[b->nranges].start = start;
+    b->ranges[b->nranges].label = label;
+    b->nranges++;
+}
+
+/* Compile prefixes into ranges with a sweep over the sorted prefixes,
+ * keeping a stack of the enclosing prefixes still open. Prefixes nest
+ * or are disjoint, so the innermost open prefix labels each address.
+ * A repeated prefix takes the label from its last line.
+ */
+static void
+netbuilder_compile(struct netbuilder *b, struct netprefix *p, int n,
+                   struct netkey max)
+{
+    b->nranges = 0;
+    b->open = grow(b->open, &b->cap_open, n + 1, sizeof(*b->open));
+    qsort(p, n, sizeof(*p), netprefix_cmp);
+    netbuilder_range(b, (struct netkey){0, 0}, -1);
+    for (int i = 0, depth = 0; i <= n; i++) {
+        while (depth && (i == n ||
+                netkey_cmp(p[b->open[depth - 1]].last, p[i].first) < 0)) {
+            struct netkey next = p[b->open[--depth]].last;
+            if (!netkey_cmp(next, max))
+                continue;  /* ends with the key space */
+            if (!++next.lo)
+                next.hi++;
+            netbuilder_range(b, next,
+                             depth ? p[b->open[depth - 1]].label : -1);
+        }
+        if (i < n) {
+            netbuilder_range(b, p[i].first, p[i].label);
+            b->open[depth++] = i;
+        }
+    }
+}
+
+/* Parse a "CIDR,label" line, returning 0 on success. Without a label the
+ * prefix itself is the label.
+ */
+static int
+netbuilder_parse(struct netbuilder *b, char *line, int lineno)
+{
+    char *label = line;
+    char *comma = strchr(line, ',');
+    if (comma) {
+        char *end = comma;
+        while (end > line && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        *end = 0;
+        label = comma + 1 + strspn(comma + 1, " \t");
+    }
+
+    char *slash = strchr(line, '/');
+    if (slash)
+        *slash = 0;
+
+    unsigned char addr[16] = {0};
+    int bits, max;
+    if (strchr(line, ':')) {
+        if (inet_pton(AF_INET6, line, addr) != 1)
+            return -1;
+        bits = 0;
+        max = 128;
+    } else {
+        if (inet_pton(AF_INET, line, addr + 12) != 1)
+            return -1;
+        memcpy(addr, v4mapped, sizeof(v4mapped));
+        bits = 96;
+        max = 32;
+    }
+
+    if (slash) {
+        errno = 0;
+        char *end;
+        long len = strtol(slash + 1, &end, 10);
+        if (errno || *end || len < 0 || len > max)
+            return -1;
+        bits += len;
+        *slash = '/';
+    } else {
+        bits += max;
+    }
+
+    /* IPv4-mapped prefixes go in the IPv4 ranges */
+    int v4 = bits >= 96 && is_v4mapped(addr);
+    struct netprefix *p;
+    if (v4) {
+        b->v4 = grow(b->v4, &b->cap_v4, b->n4 + 1, sizeof(*b->v4));
+        p = b->v4 + b->n4++;
+        memset(addr, 0, sizeof(v4mapped));
+    } else {
+        b->v6 = grow(b->v6, &b->cap_v6, b->n6 + 1, sizeof(*b->v6));
+        p = b->v6 + b->n6++;
+    }
+
+    p->first.hi = p->first.lo = 0;
+    for (int i = 0; i < 8; i++) {
+        p->first.hi = p->first.hi << 8 | addr[i];
+        p->first.lo = p->first.lo << 8 | addr[i + 8];
+    }
+    int hostbits = 128 - bits;
+    int hibits = hostbits > 64 ? hostbits - 64 : 0;
+    int lobits = hostbits > 64 ? 64 : hostbits;
+    unsigned long long himask = hibits == 64 ? -1ULL : (1ULL << hibits) - 1;
+    unsigned long long lomask = lobits == 64 ? -1ULL : (1ULL << lobits) - 1;
+    p->first.hi &= ~himask;
+    p->first.lo &= ~lomask;
+    p->last.hi = p->first.hi | himask;
+    p->last.lo = p->first.lo | lomask;
+    p->label = strtab_intern(&b->names, label, strlen(label));
+    p->line = lineno;
+    return 0;
+}
+
+static void
+netbuilder_free(struct netbuilder *b)
+{
+    free(b->v4);
+    free(b->v6);
+    free(b->ranges);
+    free(b->open);
+    strtab_free(&b->names);
+}
+
+/* Compile a prefix file into an image written to out, returning -1 on
+ * error. Bad lines are reported and skipped.
+ */
+static int
+nettable_build(const char *file, FILE *out)
+{
+    FILE *in = fopen(file, "r");
+    if (!in)
+        return -1;
+
+    struct netbuilder b = {0};
+    char buf[256];
+    int lineno = 0;
+    while (fgets(buf, sizeof(buf), in)) {
+        lineno++;
+        if (!strchr(buf, '\n')) {
+            int c = fgetc(in);
+            if (c != EOF && c != '\n') {
+                fprintf(stderr, "%s:%d: Line too long\n", file, lineno);
+                while (c != EOF && c != '\n')
+                    c = fgetc(in);
+                continue;
+            }
+        }
+        char *line = buf + strspn(buf, " \t");
+        size_t len = strcspn(line, "#\r\n");
+        while (len && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+            len--;
+        line[len] = 0;
+        if (!len)
+            continue;
+        if (netbuilder_parse(&b, line, lineno))
+            fprintf(stderr, "%s:%d: Invalid prefix\n", file, lineno);
+    }
+    int err = ferror(in);
+    fclose(in);
+    if (err) {
+        netbuilder_free(&b);
+        return -1;
+    }
+
+    /* Renumber labels in name order */
+    int nlabels = b.names.count;
+    struct netname *names = malloc((nlabels + 1) * sizeof(*names));
+    int *rank = malloc((nlabels + 1) * sizeof(*rank));
+    if (!names || !rank)
+        die();
+    for (int i = 0; i < nlabels; i++) {
+        names[i].name = strtab_get(&b.names, i);
+        names[i].label = i;
+    }
+    qsort(names, nlabels, sizeof(*names), netname_cmp);
+    for (int i = 0; i < nlabels; i++)
+        rank[names[i].label] = i;
+    for (int i = 0; i < b.n4; i++)
+        b.v4[i].label = rank[b.v4[i].label];
+    for (int i = 0; i < b.n6; i++)
+        b.v6[i].label = rank[b.v6[i].label];
+    free(rank);
+
+    struct netimage h;
+    memcpy(h.magic, NETIMAGE_MAGIC, sizeof(h.magic));
+    h.nlabels = nlabels;
+    h.len_strings = b.names.len_chars;
+
+    /* IPv4 ranges */
+    netbuilder_compile(&b, b.v4, b.n4, (struct netkey){0, 0xffffffff});
+    h.n4 = b.nranges;
+    fwrite(&h, sizeof(h), 1, out);
+    for (int i = 0; i < b.nranges; i++) {
+        uint32_t start = b.ranges[i].start.lo;
+        fwrite(&start, sizeof(start), 1, out);
+    }
+    for (int i = 0; i < b.nranges; i++) {
+        int32_t label = b.ranges[i].label;
+        fwrite(&label, sizeof(label), 1, out);
+    }
+
+    /* IPv6 ranges */
+    netbuilder_compile(&b, b.v6, b.n6, (struct netkey){-1ULL, -1ULL});
+    h.n6 = b.nranges;
+    for (int i = 0; i < b.nranges; i++) {
+        unsigned char start[16];
+        for (int j = 0; j < 8; j++) {
+            start[j] = b.ranges[i].start.hi >> (56 - 8 * j);
+            start[j + 8] = b.ranges[i].start.lo >> (56 - 8 * j);
+        }
+        fwrite(start, sizeof(start), 1, out);
+    }
+    for (int i = 0; i < b.nranges; i++) {
+        int32_t label = b.ranges[i].label;
+        fwrite(&label, sizeof(label), 1, out);
+    }
+
+    /* Label names */
+    int32_t offset = 0;
+    for (int i = 0; i < nlabels; i++) {
+        fwrite(&offset, sizeof(offset), 1, out);
+        offset += strlen(names[i].name) + 1;
+    }
+    for (int i = 0; i < nlabels; i++)
+        fwrite(names[i].name, strlen(names[i].name) + 1, 1, out);
+    free(names);
+    netbuilder_free(&b);
+
+    /* Now that the IPv6 count is known, complete the header */
+    if (fflush(out) == EOF || fseek(out, 0, SEEK_SET) ||
+            fwrite(&h, sizeof(h), 1, out) != 1 || fflush(out) == EOF)
+        return -1;
+    return 0;
+}
+
+static unsigned
+rand16(unsigned long s[1])
+{
+    s[0] = s[0] * 1103515245UL + 12345UL;
+    return (s[0] >> 16) & 0xffff;
+}
+
+static int
+randline(char *line, int maxlen, unsigned long s[1])
+{
+    int len = 3 + rand16(s) % (maxlen - 2);
+    for (int i = 0; i < len - 2; i++)
+        line[i] = 32 + rand16(s) % 95;
+    line[len - 2] = 13;
+    line[len - 1] = 10;
+    if (memcmp(line, "SSH-", 4) == 0)
+        line[0] = 'X';
+    return len;
+}
+
+static volatile sig_atomic_t running = 1;
+
+static void
+sigterm_handler(int signal)
+{
+    (void)signal;
+    running = 0;
+}
+
+static volatile sig_atomic_t reload = 0;
+
+static void
+sighup_handler(int signal)
+{
+    (void)signal;
+    reload = 1;
+}
+
+static volatile sig_atomic_t dumpstats = 0;
+
+static void
+sigusr1_handler(int signal)
+{
+    (void)signal;
+    dumpstats = 1;
+}
+
+static volatile sig_atomic_t childexit = 0;
+
+static void
+sigchld_handler(int signal)
+{
+    (void)signal;
+    childexit = 1;
+}
+
+struct config {
+    int port;
+    int delay;
+    int max_line_length;
+    int max_clients;
+    int bind_family;
+    int max_delay;
+    int delay_step;
+    char prefix_file[256];
+    char statsd_address[64];
+    char statsd_prefix[64];
+    int statsd_interval;
+    char offender_file[256];
+    char offender_hook[256];
+    int offender_format;
+    int offender_seconds;
+    int offender_connects;
+    int offender_interval;
+    int banner_capture;
+};
+
+enum offender_format {
+    OFFENDER_NFT,
+    OFFENDER_IPSET,
+};
+
+#define CONFIG_DEFAULT { \
+    .port              = DEFAULT_PORT, \
+    .delay             = DEFAULT_DELAY, \
+    .max_line_length   = DEFAULT_MAX_LINE_LENGTH, \
+    .max_clients       = DEFAULT_MAX_CLIENTS, \
+    .bind_family       = DEFAULT_BIND_FAMILY, \
+    .max_delay         = DEFAULT_MAX_DELAY, \
+    .delay_step        = DEFAULT_DELAY_STEP, \
+    .prefix_file       = "", \
+    .statsd_address    = "", \
+    .statsd_prefix     = DEFAULT_STATSD_PREFIX, \
+    .statsd_interval   = DEFAULT_STATSD_INTERVAL, \
+    .offender_file     = "", \
+    .offender_hook     = "", \
+    .offender_format   = OFFENDER_NFT, \
+    .offender_seconds  = DEFAULT_OFFENDER_SECONDS, \
+    .offender_connects = DEFAULT_OFFENDER_CONNECTS, \
+    .offender_interval = DEFAULT_OFFENDER_INTERVAL, \
+    .banner_capture    = DEFAULT_BANNER_CAPTURE, \
+}
+
+/* Delay for clients at an escalation level. The delay doubles at each
+ * level until it reaches MaxDelay. Escalation is disabled when MaxDelay
+ * is not larger than Delay.
+ */
+static int
+config_delay(const struct config *c, int level)
+{
+    if (c->max_delay <= c->delay)
+        return c->delay;
+    long long delay = (long long)c->delay << level;
+    return delay < c->max_delay ? delay : c->max_delay;
+}
+
+static void
+config_set_port(struct config *c, const char *s, int hardfail)
+{
+    errno = 0;
+    char *end;
+    long tmp = strtol(s, &end, 10);
+    if (errno || *end || tmp < 1 || tmp > 65535) {
+        fprintf(stderr, "endlessh: Invalid port: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    } else {
+        c->port = tmp;
+    }
+}
+
+static void
+config_set_delay(struct config *c, const char *s, int hardfail)
+{
+    errno = 0;
+    char *end;
+    long tmp = strtol(s, &end, 10);
+    if (errno || *end || tmp < 1 || tmp > INT_MAX) {
+        fprintf(stderr, "endlessh: Invalid delay: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    } else {
+        c->delay = tmp;
+    }
+}
+
+static void
+config_set_max_delay(struct config *c, const char *s, int hardfail)
+{
+    errno = 0;
+    char *end;
+    long tmp = strtol(s, &end, 10);
+    if (errno || *end || tmp < 0 || tmp > INT_MAX) {
+        fprintf(stderr, "endlessh: Invalid max delay: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    } else {
+        c->max_delay = tmp;
+    }
+}
+
+static void
+config_set_delay_step(struct config *c, const char *s, int hardfail)
+{
+    errno = 0;
+    char *end;
+    long tmp = strtol(s, &end, 10);
+    if (errno || *end || tmp < 1 || tmp > INT_MAX) {
+        fprintf(stderr, "endlessh: Invalid delay step: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    } else {
+        c->delay_step = tmp;
+    }
 }
 
 static void
-die(void)
+config_set_prefix_file(struct config *c, const char *s, int hardfail)
 {
-    fprintf(stderr, "endlessh: fatal: %s\n", strerror(errno));
-    exit(EXIT_FAILURE);
+    size_t len = strlen(s);
+    if (len >= sizeof(c->prefix_file)) {
+        fprintf(stderr, "endlessh: Invalid prefix file: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    } else {
+        memcpy(c->prefix_file, s, len + 1);
+    }
 }
 
-static unsigned
-rand16(unsigned long s[1])
+/* Parse "ADDR:PORT" or "[ADDR6]:PORT" into a socket address. */
+static int
+sockaddr_parse(const char *s, struct sockaddr_storage *addr, socklen_t *len)
 {
-    s[0] = s[0] * 1103515245UL + 12345UL;
-    return (s[0] >> 16) & 0xffff;
+    char host[INET6_ADDRSTRLEN + 2];
+    const char *colon = strrchr(s, ':');
+    if (!colon || colon - s >= (long)sizeof(host))
+        return -1;
+    memcpy(host, s, colon - s);
+    host[colon - s] = 0;
+
+    errno = 0;
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+    if (errno || *end || port < 1 || port > 65535)
+        return -1;
+
+    memset(addr, 0, sizeof(*addr));
+    size_t hostlen = strlen(host);
+    if (hostlen > 2 && host[0] == '[' && host[hostlen - 1] == ']') {
+        struct sockaddr_in6 *a = (struct sockaddr_in6 *)addr;
+        host[hostlen - 1] = 0;
+        a->sin6_family = AF_INET6;
+        a->sin6_port = htons(port);
+        if (inet_pton(AF_INET6, host + 1, &a->sin6_addr) != 1)
+            return -1;
+        *len = sizeof(*a);
+    } else {
+        struct sockaddr_in *a = (struct sockaddr_in *)addr;
+        a->sin_family = AF_INET;
+        a->sin_port = htons(port);
+        if (inet_pton(AF_INET, host, &a->sin_addr) != 1)
+            return -1;
+        *len = sizeof(*a);
+    }
+    return 0;
 }
 
-static int
-randline(char *line, int maxlen, unsigned long s[1])
+static void
+config_set_statsd_address(struct config *c, const char *s, int hardfail)
 {
-    int len = 3 + rand16(s) % (maxlen - 2);
-    for (int i = 0; i < len - 2; i++)
-        line[i] = 32 + rand16(s) % 95;
-    line[len - 2] = 13;
-    line[len - 1] = 10;
-    if (memcmp(line, "SSH-", 4) == 0)
-        line[0] = 'X';
-    return len;
+    struct sockaddr_storage addr;
+    socklen_t len;
+    if (strlen(s) >= sizeof(c->statsd_address) ||
+            sockaddr_parse(s, &addr, &len)) {
+        fprintf(stderr, "endlessh: Invalid StatsD address: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    } else {
+        strcpy(c->statsd_address, s);
+    }
 }
 
-static volatile sig_atomic_t running = 1;
-
 static void
-sigterm_handler(int signal)
+config_set_statsd_prefix(struct config *c, const char *s, int hardfail)
 {
-    (void)signal;
-    running = 0;
+    if (strlen(s) >= sizeof(c->statsd_prefix) || strpbrk(s, ":|@")) {
+        fprintf(stderr, "endlessh: Invalid StatsD prefix: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    } else {
+        strcpy(c->statsd_prefix, s);
+    }
 }
 
-static volatile sig_atomic_t reload = 0;
-
 static void
-sighup_handler(int signal)
+config_set_statsd_interval(struct config *c, const char *s, int hardfail)
 {
-    (void)signal;
-    reload = 1;
+    errno = 0;
+    char *end;
+    long tmp = strtol(s, &end, 10);
+    if (errno || *end || tmp < 100 || tmp > INT_MAX) {
+        fprintf(stderr, "endlessh: Invalid StatsD interval: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    } else {
+        c->statsd_interval = tmp;
+    }
 }
 
-static volatile sig_atomic_t dumpstats = 0;
-
 static void
-sigusr1_handler(int signal)
+config_set_offender_file(struct config *c, const char *s, int hardfail)
 {
-    (void)signal;
-    dumpstats = 1;
+    if (strlen(s) >= sizeof(c->offender_file)) {
+        fprintf(stderr, "endlessh: Invalid offender file: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    } else {
+        strcpy(c->offender_file, s);
+    }
 }
 
-struct config {
-    int port;
-    int delay;
-    int max_line_length;
-    int max_clients;
-    int bind_family;
-};
+static void
+config_set_offender_hook(struct config *c, const char *s, int hardfail)
+{
+    if (strlen(s) >= sizeof(c->offender_hook)) {
+        fprintf(stderr, "endlessh: Invalid offender hook: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    } else {
+        strcpy(c->offender_hook, s);
+    }
+}
 
-#define CONFIG_DEFAULT { \
-    .port            = DEFAULT_PORT, \
-    .delay           = DEFAULT_DELAY, \
-    .max_line_length = DEFAULT_MAX_LINE_LENGTH, \
-    .max_clients     = DEFAULT_MAX_CLIENTS, \
-    .bind_family     = DEFAULT_BIND_FAMILY, \
+static void
+config_set_offender_format(struct config *c, const char *s, int hardfail)
+{
+    if (!strcmp(s, "nft")) {
+        c->offender_format = OFFENDER_NFT;
+    } else if (!strcmp(s, "ipset")) {
+        c->offender_format = OFFENDER_IPSET;
+    } else {
+        fprintf(stderr, "endlessh: Invalid offender format: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    }
 }
 
 static void
-config_set_port(struct config *c, const char *s, int hardfail)
+config_set_offender_int(int *dst, const char *s, int min,
+                        const char *what, int hardfail)
 {
     errno = 0;
     char *end;
     long tmp = strtol(s, &end, 10);
-    if (errno || *end || tmp < 1 || tmp > 65535) {
-        fprintf(stderr, "endlessh: Invalid port: %s\n", s);
+    if (errno || *end || tmp < min || tmp > INT_MAX) {
+        fprintf(stderr, "endlessh: Invalid offender %s: %s\n", what, s);
         if (hardfail)
             exit(EXIT_FAILURE);
     } else {
-        c->port = tmp;
+        *dst = tmp;
     }
 }
 
 static void
-config_set_delay(struct config *c, const char *s, int hardfail)
+config_set_banner_capture(struct config *c, const char *s, int hardfail)
 {
     errno = 0;
     char *end;
     long tmp = strtol(s, &end, 10);
-    if (errno || *end || tmp < 1 || tmp > INT_MAX) {
-        fprintf(stderr, "endlessh: Invalid delay: %s\n", s);
+    if (errno || *end || tmp < 0 || tmp > BANNER_MAX - 1) {
+        fprintf(stderr, "endlessh: Invalid banner capture: %s\n", s);
         if (hardfail)
             exit(EXIT_FAILURE);
     } else {
-        c->delay = tmp;
+        c->banner_capture = tmp;
     }
 }
 
@@ -400,18 +2018,44 @@ enum config_key {
     KEY_MAX_CLIENTS,
     KEY_LOG_LEVEL,
     KEY_BIND_FAMILY,
+    KEY_MAX_DELAY,
+    KEY_DELAY_STEP,
+    KEY_PREFIX_FILE,
+    KEY_STATSD_ADDRESS,
+    KEY_STATSD_PREFIX,
+    KEY_STATSD_INTERVAL,
+    KEY_OFFENDER_FILE,
+    KEY_OFFENDER_FORMAT,
+    KEY_OFFENDER_HOOK,
+    KEY_OFFENDER_SECONDS,
+    KEY_OFFENDER_CONNECTS,
+    KEY_OFFENDER_INTERVAL,
+    KEY_BANNER_CAPTURE,
 };
 
 static enum config_key
 config_key_parse(const char *tok)
 {
     static const char *const table[] = {
-        [KEY_PORT]            = "Port",
-        [KEY_DELAY]           = "Delay",
-        [KEY_MAX_LINE_LENGTH] = "MaxLineLength",
-        [KEY_MAX_CLIENTS]     = "MaxClients",
-        [KEY_LOG_LEVEL]       = "LogLevel",
-        [KEY_BIND_FAMILY]     = "BindFamily"
+        [KEY_PORT]              = "Port",
+        [KEY_DELAY]             = "Delay",
+        [KEY_MAX_LINE_LENGTH]   = "MaxLineLength",
+        [KEY_MAX_CLIENTS]       = "MaxClients",
+        [KEY_LOG_LEVEL]         = "LogLevel",
+        [KEY_BIND_FAMILY]       = "BindFamily",
+        [KEY_MAX_DELAY]         = "MaxDelay",
+        [KEY_DELAY_STEP]        = "DelayStep",
+        [KEY_PREFIX_FILE]       = "PrefixFile",
+        [KEY_STATSD_ADDRESS]    = "StatsdAddress",
+        [KEY_STATSD_PREFIX]     = "StatsdPrefix",
+        [KEY_STATSD_INTERVAL]   = "StatsdInterval",
+        [KEY_OFFENDER_FILE]     = "OffenderFile",
+        [KEY_OFFENDER_FORMAT]   = "OffenderFormat",
+        [KEY_OFFENDER_HOOK]     = "OffenderHook",
+        [KEY_OFFENDER_SECONDS]  = "OffenderSeconds",
+        [KEY_OFFENDER_CONNECTS] = "OffenderConnects",
+        [KEY_OFFENDER_INTERVAL] = "OffenderInterval",
+        [KEY_BANNER_CAPTURE]    = "BannerCapture",
     };
     for (size_t i = 1; i < sizeof(table) / sizeof(*table); i++)
         if (!strcmp(tok, table[i]))
@@ -481,6 +2125,48 @@ config_load(struct config *c, const char *file, int hardfail)
                 case KEY_BIND_FAMILY:
                     config_set_bind_family(c, tokens[1], hardfail);
                     break;
+                case KEY_MAX_DELAY:
+                    config_set_max_delay(c, tokens[1], hardfail);
+                    break;
+                case KEY_DELAY_STEP:
+                    config_set_delay_step(c, tokens[1], hardfail);
+                    break;
+                case KEY_PREFIX_FILE:
+                    config_set_prefix_file(c, tokens[1], hardfail);
+                    break;
+                case KEY_STATSD_ADDRESS:
+                    config_set_statsd_address(c, tokens[1], hardfail);
+                    break;
+                case KEY_STATSD_PREFIX:
+                    config_set_statsd_prefix(c, tokens[1], hardfail);
+                    break;
+                case KEY_STATSD_INTERVAL:
+                    config_set_statsd_interval(c, tokens[1], hardfail);
+                    break;
+                case KEY_OFFENDER_FILE:
+                    config_set_offender_file(c, tokens[1], hardfail);
+                    break;
+                case KEY_OFFENDER_FORMAT:
+                    config_set_offender_format(c, tokens[1], hardfail);
+                    break;
+                case KEY_OFFENDER_HOOK:
+                    config_set_offender_hook(c, tokens[1], hardfail);
+                    break;
+                case KEY_OFFENDER_SECONDS:
+                    config_set_offender_int(&c->offender_seconds, tokens[1],
+                                            1, "seconds", hardfail);
+                    break;
+                case KEY_OFFENDER_CONNECTS:
+                    config_set_offender_int(&c->offender_connects, tokens[1],
+                                            0, "connects", hardfail);
+                    break;
+                case KEY_OFFENDER_INTERVAL:
+                    config_set_offender_int(&c->offender_interval, tokens[1],
+                                            1000, "interval", hardfail);
+                    break;
+                case KEY_BANNER_CAPTURE:
+                    config_set_banner_capture(c, tokens[1], hardfail);
+                    break;
                 case KEY_LOG_LEVEL: {
                     errno = 0;
                     char *end;
@@ -511,6 +2197,26 @@ config_log(const struct config *c)
         c->bind_family == AF_INET6 ? "IPv6 Only" :
         c->bind_family == AF_INET  ? "IPv4 Only" :
                                 "IPv4 Mapped IPv6");
+    logmsg(log_info, "MaxDelay %d", c->max_delay);
+    logmsg(log_info, "DelayStep %d", c->delay_step);
+    if (*c->prefix_file)
+        logmsg(log_info, "PrefixFile %s", c->prefix_file);
+    if (*c->statsd_address) {
+        logmsg(log_info, "StatsdAddress %s", c->statsd_address);
+        logmsg(log_info, "StatsdPrefix %s", c->statsd_prefix);
+        logmsg(log_info, "StatsdInterval %d", c->statsd_interval);
+    }
+    logmsg(log_info, "BannerCapture %d", c->banner_capture);
+    if (*c->offender_file) {
+        logmsg(log_info, "OffenderFile %s", c->offender_file);
+        logmsg(log_info, "OffenderFormat %s",
+               c->offender_format == OFFENDER_IPSET ? "ipset" : "nft");
+        if (*c->offender_hook)
+            logmsg(log_info, "OffenderHook %s", c->offender_hook);
+        logmsg(log_info, "OffenderSeconds %d", c->offender_seconds);
+        logmsg(log_info, "OffenderConnects %d", c->offender_connects);
+        logmsg(log_info, "OffenderInterval %d", c->offender_interval);
+    }
 }
 
 static void
@@ -533,7 +2239,32 @@ usage(FILE *f)
     fprintf(f, "  -v        Print diagnostics to standard output "
             "(repeatable)\n");
     fprintf(f, "  -V        Print version information and exit\n");
+#if defined(ENDLESSH_SIM)
+    fprintf(f, "Simulation:\n");
+    fprintf(f, "  -R INT    Peer arrivals per virtual second [100]\n");
+    fprintf(f, "  -S INT    Random seed for the peer population [1]\n");
+    fprintf(f, "  -T INT    Virtual seconds to simulate [86400]\n");
+#endif
+}
+
+#if defined(ENDLESSH_SIM)
+#  define SIM_OPTIONS "R:S:T:"
+
+static unsigned long long
+sim_option(const char *s, unsigned long long min, unsigned long long max)
+{
+    errno = 0;
+    char *end;
+    unsigned long long tmp = strtoull(s, &end, 10);
+    if (errno || *end || *s == '-' || tmp < min || tmp > max) {
+        fprintf(stderr, "endlessh: Invalid simulation parameter: %s\n", s);
+        exit(EXIT_FAILURE);
+    }
+    return tmp;
 }
+#else
+#  define SIM_OPTIONS ""
+#endif
 
 static void
 print_version(void)
@@ -546,13 +2277,13 @@ server_create(int port, int family)
 {
     int r, s, value;
 
-    s = socket(family == AF_UNSPEC ? AF_INET6 : family, SOCK_STREAM, 0);
+    s = sys_socket(family == AF_UNSPEC ? AF_INET6 : family, SOCK_STREAM, 0);
     logmsg(log_debug, "socket() = %d", s);
     if (s == -1) die();
 
     /* Socket options are best effort, allowed to fail */
     value = 1;
-    r = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+    r = sys_setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
     logmsg(log_debug, "setsockopt(%d, SO_REUSEADDR, true) = %d", s, r);
     if (r == -1)
         logmsg(log_debug, "errno = %d, %s", errno, strerror(errno));
@@ -566,7 +2297,8 @@ server_create(int port, int family)
     if (family == AF_INET6 || family == AF_UNSPEC) {
         errno = 0;
         value = (family == AF_INET6);
-        r = setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &value, sizeof(value));
+        r = sys_setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY,
+                           &value, sizeof(value));
         logmsg(log_debug, "setsockopt(%d, IPV6_V6ONLY, true) = %d", s, r);
         if (r == -1)
             logmsg(log_debug, "errno = %d, %s", errno, strerror(errno));
@@ -579,19 +2311,19 @@ server_create(int port, int family)
             .sin_port = htons(port),
             .sin_addr = {INADDR_ANY}
         };
-        r = bind(s, (void *)&addr4, sizeof(addr4));
+        r = sys_bind(s, (void *)&addr4, sizeof(addr4));
     } else {
         struct sockaddr_in6 addr6 = {
             .sin6_family = AF_INET6,
             .sin6_port = htons(port),
             .sin6_addr = in6addr_any
         };
-        r = bind(s, (void *)&addr6, sizeof(addr6));
+        r = sys_bind(s, (void *)&addr6, sizeof(addr6));
     }
     logmsg(log_debug, "bind(%d, port=%d) = %d", s, port, r);
     if (r == -1) die();
 
-    r = listen(s, INT_MAX);
+    r = sys_listen(s, INT_MAX);
     logmsg(log_debug, "listen(%d) = %d", s, r);
     if (r == -1) die();
 
@@ -605,25 +2337,484 @@ sendline(struct client *client, int max_line_length, unsigned long *rng)
     char line[256];
     int len = randline(line, max_line_length, rng);
     for (;;) {
-        ssize_t out = write(client->fd, line, len);
+        ssize_t out = sys_write(client->fd, line, len);
         logmsg(log_debug, "write(%d) = %d", client->fd, (int)out);
         if (out == -1) {
             if (errno == EINTR) {
                 continue;      /* try again */
             } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                PROBE1(sendline_eagain, client->fd);
                 return client; /* don't care */
             } else {
+                PROBE2(sendline_error, client->fd, errno);
                 client_destroy(client);
                 return 0;
             }
         } else {
+            PROBE2(sendline, client->fd, (int)out);
             client->bytes_sent += out;
             statistics.bytes_sent += out;
+            if (client->net >= 0)
+                nettable.labels[client->net].bytes_sent += out;
             return client;
         }
     }
 }
 
+/* Schedule a client's next line, escalating its delay every DelayStep
+ * lines until it reaches MaxDelay.
+ */
+static void
+client_reschedule(struct client *c, const struct config *config,
+                  long long now)
+{
+    /* Only count lines while the level can still rise */
+    if (c->level < DELAY_LEVELS - 1 &&
+            config_delay(config, c->level) < config->max_delay &&
+            ++c->lines >= config->delay_step) {
+        c->level++;
+        c->lines = 0;
+    }
+    c->delay = config_delay(config, c->level);
+    c->send_next = now + c->delay;
+}
+
+/* Count a client under its label, including anything it already sent
+ * while under another table.
+ */
+static void
+client_net_attach(struct nettable *t, struct client *c)
+{
+    c->net = nettable_lookup(t, c->addr);
+    if (c->net >= 0) {
+        struct netlabel *label = t->labels + c->net;
+        label->connects++;
+        label->bytes_sent += c->bytes_sent;
+        label->live++;
+        label->live_since += c->connect_time;
+    }
+}
+
+/* Take a live client back out of its label, undoing client_net_attach. */
+static void
+client_net_detach(struct nettable *t, struct client *c)
+{
+    if (c->net >= 0) {
+        struct netlabel *label = t->labels + c->net;
+        label->connects--;
+        label->bytes_sent -= c->bytes_sent;
+        label->live--;
+        label->live_since -= c->connect_time;
+        c->net = -1;
+    }
+}
+
+/* Switch to a new table. Live clients move, connect and all, to their
+ * label in the new table, and the remaining counters of closed clients
+ * carry over by name.
+ */
+static void
+nettable_swap(struct queue *q, struct nettable *t)
+{
+    for (int i = 0; i < DELAY_LEVELS; i++)
+        for (struct client *c = q->levels[i].head; c; c = c->next)
+            client_net_detach(&nettable, c);
+
+    for (int i = 0; i < nettable.nlabels; i++) {
+        struct netlabel *old = nettable.labels + i;
+        if (!old->connects && !old->milliseconds && !old->bytes_sent)
+            continue;  /* nothing to carry */
+        int j = nettable_find(t, nettable_name(&nettable, i));
+        if (j >= 0) {
+            t->labels[j].connects += old->connects;
+            t->labels[j].milliseconds += old->milliseconds;
+            t->labels[j].bytes_sent += old->bytes_sent;
+        }
+    }
+    for (int i = 0; i < DELAY_LEVELS; i++)
+        for (struct client *c = q->levels[i].head; c; c = c->next)
+            client_net_attach(t, c);
+
+    nettable_free(&nettable);
+    nettable = *t;
+    if (t->image)
+        logmsg(log_info, "PrefixFile ranges=%d labels=%d",
+               t->n4 + t->n6, t->nlabels);
+}
+
+/* Replace the network table with a fresh compile of the prefix file. At
+ * startup this happens in place. Otherwise a child process compiles it
+ * so that the event loop isn't held up by a large file, and the result
+ * is picked up by nettable_collect() once the child exits.
+ */
+static void
+nettable_reload(struct queue *q, const char *file, int hardfail)
+{
+    if (netbuild.pid) {
+        netbuild.again = 1;  /* the running build may be stale */
+        return;
+    }
+    if (!*file) {
+        struct nettable t = {0};
+        nettable_swap(q, &t);
+        return;
+    }
+
+    FILE *f = tmpfile();
+    if (hardfail) {
+        struct nettable t;
+        if (!f || nettable_build(file, f) || nettable_map(&t, fileno(f))) {
+            fprintf(stderr, "endlessh: %s: %s\n", file, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        fclose(f);
+        nettable_swap(q, &t);
+        return;
+    }
+
+    pid_t pid = f ? fork() : -1;
+    if (pid == 0) {
+        /* Don't hold the tarpit's sockets open */
+        long max = sysconf(_SC_OPEN_MAX);
+        for (long fd = 3; fd < max; fd++)
+            if (fd != fileno(f))
+                close(fd);
+        if (nettable_build(file, f)) {
+            fprintf(stderr, "endlessh: %s: %s\n", file, strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
+    } else if (pid == -1) {
+        fprintf(stderr, "endlessh: warning: %s: %s\n",
+                file, strerror(errno));
+        if (f)
+            fclose(f);
+        return;
+    }
+    netbuild.pid = pid;
+    netbuild.image = f;
+}
+
+/* Switch to the table from a finished background build, if any. A build
+ * that failed or was superseded by another reload leaves the current
+ * table in place.
+ */
+static void
+nettable_collect(struct queue *q, const char *file)
+{
+    int status;
+    if (!netbuild.pid || waitpid(netbuild.pid, &status, WNOHANG) <= 0)
+        return;
+
+    struct nettable t;
+    if (netbuild.again) {
+        /* discard it */
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "endlessh: warning: %s: not reloaded\n", file);
+    } else if (nettable_map(&t, fileno(netbuild.image))) {
+        fprintf(stderr, "endlessh: warning: %s: %s\n",
+                file, strerror(errno));
+    } else {
+        nettable_swap(q, &t);
+    }
+    fclose(netbuild.image);
+    netbuild.pid = 0;
+    netbuild.image = 0;
+    if (netbuild.again) {
+        netbuild.again = 0;
+        nettable_reload(q, file, 0);
+    }
+}
+
+/* StatsD exporter. Counters are sampled once per interval and packed
+ * into as few datagrams as possible, sent without ever blocking. A
+ * datagram that can't be sent immediately is dropped.
+ */
+static struct {
+    int fd;                  /* -1 when disabled */
+    long long next;          /* time of the next flush */
+    long long connects;      /* totals at the last flush */
+    long long milliseconds;
+    long long bytes_sent;
+    long long dropped;
+    int len;
+    char buf[STATSD_DATAGRAM];
+} statsd = {.fd = -1};
+
+static void
+statsd_open(const struct config *c)
+{
+    if (statsd.fd != -1)
+        close(statsd.fd);
+    statsd.fd = -1;
+    statsd.len = 0;
+    if (!*c->statsd_address)
+        return;
+
+    struct sockaddr_storage addr;
+    socklen_t len;
+    sockaddr_parse(c->statsd_address, &addr, &len);  /* already valid */
+    int fd = socket(addr.ss_family, SOCK_DGRAM, 0);
+    logmsg(log_debug, "socket(SOCK_DGRAM) = %d", fd);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, len) == -1) {
+        fprintf(stderr, "endlessh: warning: StatsD %s: %s\n",
+                c->statsd_address, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    statsd.fd = fd;
+    statsd.next = epochms() + c->statsd_interval;
+}
+
+static void
+statsd_send(void)
+{
+    if (statsd.len) {
+        ssize_t r = send(statsd.fd, statsd.buf, statsd.len, 0);
+        logmsg(log_debug, "send(%d) = %d", statsd.fd, (int)r);
+        if (r == -1)
+            statsd.dropped++;
+        statsd.len = 0;
+    }
+}
+
+/* Append one metric line, sending the datagram first if it's full. */
+static void
+statsd_metric(const char *prefix, const char *name, long long value,
+              const char *type)
+{
+    char line[160];
+    int len = snprintf(line, sizeof(line), "%s.%s:%lld|%s\n",
+                       prefix, name, value, type);
+    if (statsd.len + len > STATSD_DATAGRAM)
+        statsd_send();
+    memcpy(statsd.buf + statsd.len, line, len);
+    statsd.len += len;
+}
+
+static void
+statsd_flush(const struct config *c, const struct queue *q, long long now)
+{
+    const char *p = c->statsd_prefix;
+    /* Held time includes clients still connected, as in TOTALS */
+    long long held = statistics.milliseconds +
+                     q->length * now - statistics.live_since;
+    statsd_metric(p, "connects", statistics.connects - statsd.connects, "c");
+    statsd_metric(p, "bytes", statistics.bytes_sent - statsd.bytes_sent, "c");
+    statsd_metric(p, "held_ms", held - statsd.milliseconds, "c");
+    statsd_metric(p, "clients", q->length, "g");
+    statsd_metric(p, "total.connects", statistics.connects, "g");
+    statsd_metric(p, "total.bytes", statistics.bytes_sent, "g");
+    statsd_metric(p, "total.held_ms", held, "g");
+    statsd_metric(p, "dropped", statsd.dropped, "g");
+    statsd_send();
+
+    statsd.connects = statistics.connects;
+    statsd.bytes_sent = statistics.bytes_sent;
+    statsd.milliseconds = held;
+    statsd.next = now + c->statsd_interval;
+}
+
+static void
+offenders_configure(const struct config *c)
+{
+    if (*c->offender_file && !offenders.slots) {
+        offenders.slots = calloc(OFFENDER_SLOTS, sizeof(*offenders.slots));
+        if (!offenders.slots)
+            die();
+    }
+    offenders.threshold_ms = c->offender_seconds * 1000LL;
+    offenders.threshold_connects = c->offender_connects;
+    if (offenders.slots)
+        for (long i = 0; i < OFFENDER_SLOTS; i++)
+            if (offenders.slots[i].used)
+                offender_update(offenders.slots + i);
+    /* The file, format, or hook may have changed */
+    offenders.full = 1;
+    offenders.dirty = 1;
+}
+
+static void
+offender_write(FILE *f, const unsigned char *a, enum offender_format fmt,
+               int add)
+{
+    char addr[INET6_ADDRSTRLEN];
+    int v4 = is_v4mapped(a);
+    if (v4)
+        inet_ntop(AF_INET, a + 12, addr, sizeof(addr));
+    else
+        inet_ntop(AF_INET6, a, addr, sizeof(addr));
+
+    switch (fmt) {
+        case OFFENDER_NFT:
+            fprintf(f, "%s element inet endlessh offenders%c { %s }\n",
+                    add ? "add" : "delete", v4 ? '4' : '6', addr);
+            break;
+        case OFFENDER_IPSET:
+            fprintf(f, "%s endlessh-offenders%c %s -exist\n",
+                    add ? "add" : "del", v4 ? '4' : '6', addr);
+            break;
+    }
+}
+
+/* Atomically replace the offender file, then run the hook, if any,
+ * without waiting for it to finish. With a hook, the file usually holds
+ * only the additions and deletions since the last export, so exports
+ * wait for the previous hook to exit, blocking only if asked to, and
+ * fall back to a full snapshot when it failed. Without a hook the file
+ * is always a full snapshot.
+ */
+static void
+offenders_export(const struct config *c, int wait)
+{
+    if (offenders.hook) {
+        int status;
+        pid_t r = waitpid(offenders.hook, &status, wait ? 0 : WNOHANG);
+        if (r == 0)
+            return;  /* still running, try again next interval */
+        offenders.hook = 0;
+        if (r == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+            offenders.full = 1;
+    }
+    int full = offenders.full || !*c->offender_hook;
+
+    char tmp[sizeof(c->offender_file) + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", c->offender_file);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "endlessh: warning: %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    long added = 0;
+    long deleted = 0;
+    if (full) {
+        switch (c->offender_format) {
+            case OFFENDER_NFT:
+                fputs("add table inet endlessh\n"
+                      "add set inet endlessh offenders4"
+                      " { type ipv4_addr; }\n"
+                      "add set inet endlessh offenders6"
+                      " { type ipv6_addr; }\n"
+                      "flush set inet endlessh offenders4\n"
+                      "flush set inet endlessh offenders6\n", f);
+                break;
+            case OFFENDER_IPSET:
+                fputs("create endlessh-offenders4 hash:ip family inet"
+                      " -exist\n"
+                      "create endlessh-offenders6 hash:ip family inet6"
+                      " -exist\n"
+                      "flush endlessh-offenders4\n"
+                      "flush endlessh-offenders6\n", f);
+                break;
+        }
+        for (long i = 0; i < OFFENDER_SLOTS; i++) {
+            struct offender *o = offenders.slots + i;
+            if (o->listed) {
+                offender_write(f, o->addr, c->offender_format, 1);
+                added++;
+            }
+        }
+    } else {
+        for (int i = 0; i < offenders.nremoved; i++)
+            offender_write(f, offenders.removed[i], c->offender_format, 0);
+        deleted = offenders.nremoved;
+        for (int i = 0; i < offenders.nchanged; i++) {
+            struct offender *o = offenders.slots + offenders.changed[i];
+            if (o->listed != o->exported) {
+                offender_write(f, o->addr, c->offender_format, o->listed);
+                added += o->listed;
+                deleted += !o->listed;
+            }
+        }
+    }
+
+    if (fclose(f) == EOF || rename(tmp, c->offender_file) == -1) {
+        fprintf(stderr, "endlessh: warning: %s: %s\n",
+                c->offender_file, strerror(errno));
+        remove(tmp);
+        return;
+    }
+
+    /* The file now reflects the listed set */
+    if (full) {
+        for (long i = 0; i < OFFENDER_SLOTS; i++)
+            offenders.slots[i].exported = offenders.slots[i].listed;
+    }
+    for (int i = 0; i < offenders.nchanged; i++) {
+        struct offender *o = offenders.slots + offenders.changed[i];
+        o->exported = o->listed;
+        o->queued = 0;
+    }
+    offenders.nchanged = 0;
+    offenders.nremoved = 0;
+    offenders.full = 0;
+    offenders.dirty = 0;
+    logmsg(log_info, "OFFENDERS listed=%ld added=%ld deleted=%ld%s file=%s",
+           offenders.listed, added, deleted, full ? " full" : "",
+           c->offender_file);
+
+    if (*c->offender_hook) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            /* Don't leak the tarpit's sockets into the hook */
+            long max = sysconf(_SC_OPEN_MAX);
+            for (long fd = 3; fd < max; fd++)
+                close(fd);
+            signal(SIGPIPE, SIG_DFL);  /* ignored dispositions survive exec */
+            execl(c->offender_hook, c->offender_hook, c->offender_file,
+                  (char *)0);
+            _exit(127);
+        } else if (pid == -1) {
+            fprintf(stderr, "endlessh: warning: fork: %s\n",
+                    strerror(errno));
+            offenders.full = 1;  /* retry with everything */
+            offenders.dirty = 1;
+        } else {
+            offenders.hook = pid;
+        }
+    }
+}
+
+/* Read a pending client's banner, once, then shrink its receive buffer.
+ * Only the first line is kept, with unprintable characters replaced.
+ */
+static void
+banner_capture(struct client *c, int len)
+{
+    ssize_t r = sys_read(c->fd, c->banner, len);
+    logmsg(log_debug, "read(%d) = %d", c->fd, (int)r);
+    if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;  /* try again on the next wakeup */
+    banner_unwatch(c);
+    socket_shrink_rcvbuf(c->fd);
+    if (r <= 0)
+        return;
+
+    c->banner[r] = 0;
+    c->banner[strcspn(c->banner, "\r\n")] = 0;
+    for (char *p = c->banner; *p; p++)
+        if (*p < 32 || *p > 126 || *p == '"')
+            *p = '?';
+
+    size_t n = strlen(c->banner);
+    if (!n)
+        return;
+    int id = strtab_find(&banners.seen, c->banner, n);
+    if (id == -1 && banners.seen.count < BANNER_DISTINCT) {
+        id = strtab_intern(&banners.seen, c->banner, n);
+        banners.counts = grow(banners.counts, &banners.cap_counts,
+                              id + 1, sizeof(*banners.counts));
+        banners.counts[id] = 0;
+    }
+    if (id == -1)
+        banners.other++;
+    else
+        banners.counts[id]++;
+}
 
 int
 main(int argc, char **argv)
@@ -641,7 +2832,8 @@ main(int argc, char **argv)
     config_load(&config, config_file, 1);
 
     int option;
-    while ((option = getopt(argc, argv, "46d:f:hl:m:p:svV")) != -1) {
+    const char *options = "46d:f:hl:m:p:svV" SIM_OPTIONS;
+    while ((option = getopt(argc, argv, options)) != -1) {
         switch (option) {
             case '4':
                 config_set_bind_family(&config, "4", 1);
@@ -687,6 +2879,17 @@ main(int argc, char **argv)
                 print_version();
                 exit(EXIT_SUCCESS);
                 break;
+#if defined(ENDLESSH_SIM)
+            case 'R':
+                sim.rate = sim_option(optarg, 1, 1000000);
+                break;
+            case 'S':
+                sim.seed = sim_option(optarg, 0, -1);
+                break;
+            case 'T':
+                sim.duration = sim_option(optarg, 1, LONG_MAX / 1000);
+                break;
+#endif
             default:
                 usage(stderr);
                 exit(EXIT_FAILURE);
@@ -731,55 +2934,134 @@ main(int argc, char **argv)
         if (r == -1)
             die();
     }
+    {
+        /* Wakes poll(), restarts everything else */
+        struct sigaction sa = {
+            .sa_handler = sigchld_handler,
+            .sa_flags = SA_RESTART,
+        };
+        int r = sigaction(SIGCHLD, &sa, 0);
+        if (r == -1)
+            die();
+    }
+
+    struct queue queue[1];
+    queue_init(queue);
 
-    struct fifo fifo[1];
-    fifo_init(fifo);
+#if defined(ENDLESSH_SIM)
+    sim_init();
+    long long sim_start = monotonicus();
+#endif
 
     unsigned long rng = epochms();
 
+    nettable_reload(queue, config.prefix_file, 1);
+    statsd_open(&config);
+    offenders_configure(&config);
+
     int server = server_create(config.port, config.bind_family);
 
+    /* The last poll() return: whether it came before its timeout and how
+     * many clients it accepted. Its sends happen on the following pass.
+     */
+    int woke = 0;
+    int woke_early = 0;
+    int accepted = 0;
     while (running) {
+        long long wake = monotonicus();
+
         if (reload) {
             /* Configuration reload requested (SIGHUP) */
             int oldport = config.port;
             int oldfamily = config.bind_family;
             config_load(&config, config_file, 0);
             config_log(&config);
+            nettable_reload(queue, config.prefix_file, 0);
+            statsd_open(&config);
+            offenders_configure(&config);
             if (oldport != config.port || oldfamily != config.bind_family) {
-                close(server);
+                sys_close(server);
                 server = server_create(config.port, config.bind_family);
             }
             reload = 0;
         }
         if (dumpstats) {
             /* print stats requested (SIGUSR1) */
-            statistics_log_totals(fifo->head);
+            statistics_log_totals(queue);
             dumpstats = 0;
         }
+        if (childexit) {
+            /* A background prefix table build may have finished */
+            childexit = 0;
+            nettable_collect(queue, config.prefix_file);
+        }
 
         /* Enqueue clients that are due for another message */
         int timeout = -1;
         long long now = epochms();
-        while (fifo->head) {
-            if (fifo->head->send_next <= now) {
-                struct client *c = fifo_pop(fifo);
+        int served = 0;
+        struct fifo *next;
+        while ((next = queue_next(queue))) {
+            if (next->head->send_next <= now) {
+                struct client *c = queue_pop(queue, next);
+                /* Read the clock per client so lateness includes
+                 * the time spent serving earlier clients this pass
+                 */
+                histogram_add(&loopstats.lateness, epochms() - c->send_next);
+                served++;
                 if (sendline(c, config.max_line_length, &rng)) {
-                    c->send_next = now + config.delay;
-                    fifo_append(fifo, c);
+                    client_reschedule(c, &config, now);
+                    queue_append(queue, c);
                 }
             } else {
-                timeout = fifo->head->send_next - now;
+                timeout = next->head->send_next - now;
                 break;
             }
         }
 
+        if (woke) {
+            loopstats.wakeups++;
+            loopstats.early_wakeups += woke_early && !served && !accepted;
+            histogram_add(&loopstats.served, served);
+            histogram_add(&loopstats.accepts, accepted);
+        }
+        histogram_add(&loopstats.iteration, monotonicus() - wake);
+        woke = woke_early = accepted = 0;
+
+        PROBE2(loop, queue->length, timeout);
+
+        /* Export statistics when due */
+        if (statsd.fd != -1) {
+            if (statsd.next <= now)
+                statsd_flush(&config, queue, now);
+            long long wait = statsd.next - now;
+            if (timeout == -1 || wait < timeout)
+                timeout = wait;
+        }
+
+        /* Export repeat offenders, batching changes by interval */
+        if (offenders.dirty && *config.offender_file) {
+            if (offenders.next <= now) {
+                offenders_export(&config, 0);
+                offenders.next = now + config.offender_interval;
+            }
+            if (offenders.dirty) {
+                long long wait = offenders.next - now;
+                if (timeout == -1 || wait < timeout)
+                    timeout = wait;
+            }
+        }
+
         /* Wait for next event */
-        struct pollfd fds = {server, POLLIN, 0};
-        int nfds = fifo->length < config.max_clients;
+        struct pollfd *fds = banners.fds;
+        fds[0].fd = queue->length < config.max_clients ? server : -1;
+        fds[0].events = POLLIN;
+        int nfds = 1 + banners.pending;
         logmsg(log_debug, "poll(%d, %d)", nfds, timeout);
-        int r = poll(&fds, nfds, timeout);
+        int r = sys_poll(fds, nfds, timeout);
         logmsg(log_debug, "= %d", r);
+        woke = 1;
+        woke_early = r != 0;  /* an event or a signal, not the timeout */
         if (r == -1) {
             switch (errno) {
                 case EINTR:
@@ -791,9 +3073,15 @@ main(int argc, char **argv)
             }
         }
 
+        /* Capture banners from clients that have sent something */
+        for (int i = banners.pending; i > 0; i--)
+            if (fds[i].revents)
+                banner_capture(banners.clients[i - 1], config.banner_capture);
+
         /* Check for new incoming connections */
-        if (fds.revents & POLLIN) {
-            int fd = accept(server, 0, 0);
+        if (fds[0].revents & POLLIN) {
+            int fd = sys_accept(server, 0, 0);
+            PROBE2(accept, fd, fd == -1 ? errno : 0);
             logmsg(log_debug, "accept() = %d", fd);
             statistics.connects++;
             if (fd == -1) {
@@ -801,10 +3089,10 @@ main(int argc, char **argv)
                 switch (errno) {
                     case EMFILE:
                     case ENFILE:
-                        config.max_clients = fifo->length;
+                        config.max_clients = queue->length;
                         logmsg(log_info,
                                 "MaxClients %d",
-                                fifo->length);
+                                queue->length);
                         break;
                     case ECONNABORTED:
                     case EINTR:
@@ -818,25 +3106,41 @@ main(int argc, char **argv)
                         exit(EXIT_FAILURE);
                 }
             } else {
-                long long send_next = epochms() + config.delay;
-                struct client *client = client_new(fd, send_next);
-                int flags = fcntl(fd, F_GETFL, 0);      /* cannot fail */
-                fcntl(fd, F_SETFL, flags | O_NONBLOCK); /* cannot fail */
+                int delay = config_delay(&config, 0);
+                int capture = config.banner_capture > 0;
+                struct client *client = client_new(fd, delay, capture);
+                int flags = sys_fcntl(fd, F_GETFL, 0);      /* cannot fail */
+                sys_fcntl(fd, F_SETFL, flags | O_NONBLOCK); /* cannot fail */
                 if (!client) {
                     fprintf(stderr, "endlessh: warning: out of memory\n");
-                    close(fd);
+                    sys_close(fd);
                 } else {
-                    fifo_append(fifo, client);
+                    queue_append(queue, client);
+                    if (capture)
+                        banner_watch(client);
+                    accepted++;
+                    client_net_attach(&nettable, client);
                     logmsg(log_info, "ACCEPT host=%s port=%d fd=%d n=%d/%d",
                             client->ipaddr, client->port, client->fd,
-                            fifo->length, config.max_clients);
+                            queue->length, config.max_clients);
                 }
             }
         }
     }
 
-    fifo_destroy(fifo);
-    statistics_log_totals(0);
+    queue_destroy(queue);
+    statistics_log_totals(queue);
+    if (statsd.fd != -1)
+        statsd_flush(&config, queue, epochms());
+    if (offenders.dirty && *config.offender_file)
+        offenders_export(&config, 1);
+    nettable_free(&nettable);
+    strtab_free(&banners.seen);
+    free(banners.counts);
+
+#if defined(ENDLESSH_SIM)
+    sim_report(sizeof(struct client), monotonicus() - sim_start);
+#endif
 
     if (logmsg == logsyslog)
         closelog();